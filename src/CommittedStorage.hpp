@@ -6,7 +6,10 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <span>
+#include <ranges>
 #include <cstring>
+#include <atomic>
 
 #include "Utils.hpp"
 
@@ -31,6 +34,13 @@ class Index {
   };
   utils::ReadOnlyFileMappedArray<IndexEntry> _file;
 
+  // Empty segments have an empty index, which cannot be mapped
+  void remapFileArray() {
+    if (std::filesystem::file_size(_indexPath) != 0) {
+      _file.remap(_indexPath);
+    }
+  }
+
   static auto getKeySlice(std::string_view key) {
     return (key.size() < KEY_SLICE_SIZE) ?
       key :
@@ -38,18 +48,24 @@ class Index {
   }
 public:
   Index(const std::string_view path) : _indexPath(std::format("{}.index", path)) {
-    const bool indexExists = std::filesystem::exists(_indexPath);
-    if (!indexExists) {
+    const bool indexIsValid =
+      std::filesystem::exists(_indexPath) &&
+      isValidFileSize(std::filesystem::file_size(_indexPath));
+    if (!indexIsValid) {
       std::ofstream indexFile(_indexPath.data(), std::ios::binary);
       std::ifstream dataFile(path.data(), std::ios::binary);
       utils::RecordStreamIteration it(dataFile);
       while (auto record = it.next()) {
-        IndexEntry entry;
-        entry.set(record->key, record->position);
-        indexFile.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        append(indexFile, record->key, record->position);
       }
     }
-    _file.remap(_indexPath);
+    remapFileArray();
+  }
+  // Appends an entry to an index file being built. Entries must be appended in key order.
+  static void append(std::ofstream& indexFile, std::string_view key, size_t position) {
+    IndexEntry entry;
+    entry.set(key, position);
+    indexFile.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
   }
   std::optional<size_t> find(std::string_view key) const {
     auto it = std::lower_bound(
@@ -64,80 +80,316 @@ public:
     }
     return it->position;
   }
+  static bool isValidFileSize(size_t size) {
+    return size % sizeof(IndexEntry) == 0;
+  }
+  auto& mapping() { return _file; }
+  const auto& mapping() const { return _file; }
   void rename(std::string_view newPath) {
     const auto newIndexPath = std::format("{}.index", newPath);
     std::filesystem::rename(_indexPath, newIndexPath);
     _indexPath = newIndexPath;
-    _file.remap(_indexPath);
+    remapFileArray();
+  }
+};
+
+// Decides which versions of a key survive compaction. Records must be fed sorted by key
+// and then from newest to oldest. A version is shadowed by the next newer version of its
+// key or by a newer range tombstone covering it. Unshadowed versions are always kept; a
+// shadowed one only if a live snapshot sits between it and whatever shadows it.
+class VersionRetention {
+  std::span<const size_t> _snapshots; // Sorted ascending
+  const utils::RangeTombstones& _rangeTombstones;
+  std::string _key;
+  size_t _newerSequence = utils::LATEST_SEQUENCE;
+public:
+  VersionRetention(std::span<const size_t> snapshots, const utils::RangeTombstones& rangeTombstones)
+    : _snapshots(snapshots), _rangeTombstones(rangeTombstones) {}
+  bool keep(std::string_view key, size_t sequence) {
+    if (key != _key) {
+      _key = key;
+      _newerSequence = utils::LATEST_SEQUENCE;
+    }
+    const size_t shadowedAt = std::min(
+      _newerSequence,
+      _rangeTombstones.oldestCoveringAfter(key, sequence));
+    _newerSequence = sequence;
+    if (shadowedAt == utils::LATEST_SEQUENCE) {
+      return true;
+    }
+    auto it = std::lower_bound(_snapshots.begin(), _snapshots.end(), sequence);
+    return (it != _snapshots.end()) && (*it < shadowedAt);
   }
 };
 
 // Allows access to a single segment of the sorted committed storage via
 // memory-mapped file i/o.
-// On start-up the segment is scanned and the index and bloom filter are populated.
+// Records are sorted by key and, for the same key, from the newest to the oldest version.
+// Range tombstones are kept in a separate '.ranges' file next to the segment and are
+// loaded into memory.
+// An ingested segment has a '.sequence' file holding the sequence shared by all its records.
+// On start-up the index and bloom filter are memory-mapped, or built by scanning the
+// segment if they are missing or of the wrong size.
 class CommittedStorage {
   std::string _path;
   utils::ReadOnlyFileMappedArray<char> _file;
   Index _index;
-  utils::BloomFilter _bloomFilter;
+  utils::ReadOnlyFileMappedArray<utils::BloomFilter> _bloomFilter;
+  utils::RangeTombstones _rangeTombstones;
+  size_t _ingestedSequence;
+
+  // Lookups that reached the data file, decayed by the residency manager. Updated
+  // atomically, as lookups run concurrently with the manager.
+  alignas(std::atomic_ref<size_t>::required_alignment) mutable size_t _heat = 0;
+  bool _metadataPinned = false;
 
   void remapFileArray() {
     if (std::filesystem::exists(_path) && std::filesystem::file_size(_path) != 0) {
       _file.remap(_path);
     }
   }
+
+  static std::string rangeTombstonesPath(std::string_view path) {
+    return std::format("{}.ranges", path);
+  }
+
+  static size_t readIngestedSequence(std::string_view path) {
+    size_t sequence = utils::UNASSIGNED_SEQUENCE;
+    std::ifstream file(sequencePath(path), std::ios::binary);
+    file.read(reinterpret_cast<char*>(&sequence), sizeof(size_t));
+    return sequence;
+  }
+
+  static size_t resolveSequence(size_t recordSequence, size_t ingestedSequence) {
+    return (recordSequence == utils::UNASSIGNED_SEQUENCE) ? ingestedSequence : recordSequence;
+  }
+
+  // Sequence of the newest range tombstone removing 'key' as of 'sequence', or 0.
+  size_t newestCoveringTombstone(std::string_view key, size_t sequence) const {
+    return _rangeTombstones.empty() ? 0 : _rangeTombstones.newestCovering(key, sequence);
+  }
+
+  static utils::RangeTombstones readRangeTombstones(std::string_view path) {
+    utils::RangeTombstones result;
+    std::ifstream file(rangeTombstonesPath(path), std::ios::binary);
+    utils::RecordStreamIteration it(file);
+    while (auto record = it.next()) {
+      result.add(record->key, record->value, record->sequence);
+    }
+    return result;
+  }
+
+  static void writeRangeTombstones(std::string_view path, const utils::RangeTombstones& tombstones) {
+    if (tombstones.empty()) {
+      return;
+    }
+    std::ofstream file(rangeTombstonesPath(path), std::ios::binary);
+    for (const auto& fragment : tombstones) {
+      for (const size_t sequence : fragment.sequences) {
+        utils::writeRecordToFile<false /*flush*/>(file, {fragment.start, fragment.end, sequence});
+      }
+    }
+  }
 public:
-  CommittedStorage(std::string_view path) : _path(path), _index(path) {
+  CommittedStorage(std::string_view path)
+    : _path(path),
+    _index(path),
+    _rangeTombstones(readRangeTombstones(path)),
+    _ingestedSequence(readIngestedSequence(path))
+  {
     remapFileArray();
-    utils::RecordIteration it(std::string_view(_file.begin(), _file.end()));
-    while (auto record = it.next()) {
-      _bloomFilter.add(record->key);
+    // A filter of the wrong size would be read out of bounds
+    const bool filterIsValid =
+      std::filesystem::exists(filterPath(path)) &&
+      (std::filesystem::file_size(filterPath(path)) == sizeof(utils::BloomFilter));
+    if (!filterIsValid) {
+      utils::BloomFilter bloomFilter;
+      utils::RecordIteration it(std::string_view(_file.begin(), _file.end()));
+      while (auto record = it.next()) {
+        bloomFilter.add(record->key);
+      }
+      std::ofstream filterFile(filterPath(path), std::ios::binary);
+      bloomFilter.write(filterFile);
     }
+    _bloomFilter.remap(filterPath(path));
   }
 
-  bool get(std::string& output, std::string_view key) const {
-    if (!_bloomFilter.contains(key)) {
-      return false;
+  static std::string filterPath(std::string_view path) {
+    return std::format("{}.filter", path);
+  }
+
+  static std::string sequencePath(std::string_view path) {
+    return std::format("{}.sequence", path);
+  }
+
+  // Marks a segment built outside of the database as written at 'sequence'.
+  static void assignSequence(std::string_view path, size_t sequence) {
+    std::ofstream file(sequencePath(path), std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&sequence), sizeof(size_t));
+  }
+
+  utils::Lookup get(std::string& output, std::string_view key, size_t sequence) const {
+    // Most segments hold no range tombstones, so the bloom filter is checked first
+    if (!_bloomFilter[0].contains(key)) {
+      return newestCoveringTombstone(key, sequence) ? utils::Lookup::Removed : utils::Lookup::Missing;
     }
+    const size_t removedAt = newestCoveringTombstone(key, sequence);
+    const auto notFound = removedAt ? utils::Lookup::Removed : utils::Lookup::Missing;
     const auto positionInFile = _index.find(key);
     if (!positionInFile) {
-      return false;
+      return notFound;
     }
+    std::atomic_ref(_heat).fetch_add(1, std::memory_order_relaxed);
 
     utils::RecordIteration records(std::string_view(_file.begin() + *positionInFile, _file.end()));
     while (auto record = records.next()) {
-      if (record->key == key) {
-        if (record->value == utils::TOMBSTONE) {
-          return false;
-        }
-        output = record->value;
-        return true;
+      if (record->key < key) {
+        continue;
       }
+      if (record->key > key) {
+        break;
+      }
+      const size_t recordSequence = resolveSequence(record->sequence, _ingestedSequence);
+      if (recordSequence > sequence) {
+        continue;
+      }
+      if (recordSequence < removedAt) {
+        break;
+      }
+      if (record->value == utils::TOMBSTONE) {
+        return utils::Lookup::Removed;
+      }
+      output = record->value;
+      return utils::Lookup::Found;
+    }
+    return notFound;
+  }
+
+  // Residency control, driven by the 'ResidencyManager'.
+  // Metadata (the index and bloom filter) is locked into memory once and stays locked.
+  bool pinMetadata(bool hugePages) {
+    if (_metadataPinned) {
+      return true;
+    }
+    if (hugePages) {
+      _index.mapping().advise(MADV_HUGEPAGE);
+      _bloomFilter.advise(MADV_HUGEPAGE);
+    }
+    const bool indexLocked = _index.mapping().lock();
+    _metadataPinned = indexLocked && _bloomFilter.lock();
+    if (!_metadataPinned && indexLocked) {
+      _index.mapping().unlock();
+    }
+    return _metadataPinned;
+  }
+  bool metadataPinned() const { return _metadataPinned; }
+  size_t metadataBytes() const {
+    return _index.mapping().sizeInBytes() + _bloomFilter.sizeInBytes();
+  }
+  size_t residentMetadataBytes() const {
+    return _index.mapping().residentBytes() + _bloomFilter.residentBytes();
+  }
+  size_t dataBytes() const { return _file.sizeInBytes(); }
+  size_t residentDataBytes() const { return _file.residentBytes(); }
+  void adviseRandomAccess() { _file.advise(MADV_RANDOM); }
+  void prefetchData(size_t bytes) { _file.advise(MADV_WILLNEED, bytes); }
+  void evictData(size_t keptBytes = 0) { _file.evict(keptBytes); }
+  size_t heat() const { return std::atomic_ref(_heat).load(std::memory_order_relaxed); }
+  void coolDown() {
+    auto heat = std::atomic_ref(_heat);
+    size_t current = heat.load(std::memory_order_relaxed);
+    while (!heat.compare_exchange_weak(current, current / 2, std::memory_order_relaxed)) {}
+  }
+
+  // The sequence assigned to every record of an ingested segment, if it is one.
+  size_t ingestedSequence() const {
+    return _ingestedSequence;
+  }
+
+  // Scans the segment, so it is meant to be used on start-up only.
+  size_t maxSequence() const {
+    if (_ingestedSequence != utils::UNASSIGNED_SEQUENCE) {
+      return _ingestedSequence;
+    }
+    size_t result = 0;
+    utils::RecordIteration it(std::string_view(_file.begin(), _file.end()));
+    while (auto record = it.next()) {
+      result = std::max(result, record->sequence);
     }
-    return false;
+    return std::max(result, _rangeTombstones.maxSequence());
   }
 
   void rename(std::string_view newPath) {
     std::filesystem::rename(_path, newPath);
+    std::filesystem::rename(filterPath(_path), filterPath(newPath));
+    if (!_rangeTombstones.empty()) {
+      std::filesystem::rename(rangeTombstonesPath(_path), rangeTombstonesPath(newPath));
+    }
     _path = newPath;
     _index.rename(newPath);
+    _bloomFilter.remap(filterPath(newPath));
+    _metadataPinned = false;
+  }
+
+  // The segment file and the files that may accompany it.
+  static std::vector<std::string> filePaths(std::string_view path) {
+    return {
+      std::string(path),
+      std::format("{}.index", path),
+      filterPath(path),
+      rangeTombstonesPath(path),
+      sequencePath(path)
+    };
+  }
+
+  static void removeFiles(std::string_view path) {
+    for (const auto& file : filePaths(path)) {
+      std::filesystem::remove(file);
+    }
+  }
+
+  // Moves whichever of the segment's files exist. The segment file goes last, as its
+  // presence is what makes the segment visible on start-up.
+  static void moveFiles(std::string_view from, std::string_view to) {
+    for (const auto& file : filePaths(from) | std::views::reverse) {
+      if (std::filesystem::exists(file)) {
+        std::filesystem::rename(file, std::string(to) + file.substr(from.size()));
+      }
+    }
   }
 
   // Merges two sorted segment files into a new sorted segment file.
+  // Overwritten and range-deleted versions are dropped unless one of the live 'snapshots'
+  // can still see them. Range tombstones are carried over, unless 'dropRangeTombstones' is
+  // set because no older segment or snapshot remains for them to apply to.
   static void merge(
     std::string_view outputPath,
     std::string_view newerPath,
-    std::string_view olderPath)
+    std::string_view olderPath,
+    std::span<const size_t> snapshots,
+    bool dropRangeTombstones)
   {
+    utils::RangeTombstones rangeTombstones = readRangeTombstones(newerPath);
+    rangeTombstones.append(readRangeTombstones(olderPath));
+    if (!dropRangeTombstones) {
+      writeRangeTombstones(outputPath, rangeTombstones);
+    }
+
     std::ifstream newerFile(newerPath.data(), std::ios::binary);
     std::ifstream olderFile(olderPath.data(), std::ios::binary);
     utils::RecordStreamIteration newerIt(newerFile);
     utils::RecordStreamIteration olderIt(olderFile);
 
     std::ofstream ouput(outputPath.data(), std::ios::binary);
-    auto write = [&ouput](const auto& record) {
-      utils::writeRecordToFile<false /*flush*/>(ouput, {record->key, record->value});
+    VersionRetention retention(snapshots, rangeTombstones);
+    auto write = [&ouput, &retention](const auto& record, size_t ingestedSequence) {
+      const size_t sequence = resolveSequence(record->sequence, ingestedSequence);
+      if (retention.keep(record->key, sequence)) {
+        utils::writeRecordToFile<false /*flush*/>(ouput, {record->key, record->value, sequence});
+      }
     };
+    const size_t newerIngestedSequence = readIngestedSequence(newerPath);
+    const size_t olderIngestedSequence = readIngestedSequence(olderPath);
 
     auto newer = newerIt.next();
     auto older = olderIt.next();
@@ -146,24 +398,21 @@ public:
         break;
       }
       if (!newer) {
-        write(older);
+        write(older, olderIngestedSequence);
         older = olderIt.next();
         continue;
       }
       if (!older) {
-        write(newer);
+        write(newer, newerIngestedSequence);
         newer = newerIt.next();
         continue;
       }
-      if (newer->key < older->key) {
-        write(newer);
+      // For the same key every version in the newer segment precedes those in the older one
+      if (newer->key <= older->key) {
+        write(newer, newerIngestedSequence);
         newer = newerIt.next();
-      } else if (newer->key > older->key) {
-        write(older);
-        older = olderIt.next();
       } else {
-        write(newer);
-        newer = newerIt.next();
+        write(older, olderIngestedSequence);
         older = olderIt.next();
       }
     }
@@ -172,20 +421,46 @@ public:
   }
 
   // Converts an unsorted write ahead log file to a sorted segment file.
-  static void logToSegment(std::string_view segmentPath, std::string_view logPath)
+  // Overwritten and range-deleted versions are dropped unless one of the live 'snapshots'
+  // can still see them.
+  static void logToSegment(
+    std::string_view segmentPath,
+    std::string_view logPath,
+    std::span<const size_t> snapshots)
   {
-    thread_local std::map<std::string, std::string> records;
+    struct Version {
+      size_t sequence;
+      std::string value;
+    };
+    thread_local std::map<std::string, std::vector<Version>, std::less<>> records;
     records.clear();
 
+    // The log is appended to in sequence order, so versions end up oldest first
+    utils::RangeTombstones rangeTombstones;
     std::ifstream input(logPath.data(), std::ios::binary);
     utils::RecordStreamIteration it(input);
     while (auto record = it.next()) {
-      records[std::string(record->key)] = std::string(record->value);
+      if (record->sequence & utils::RANGE_TOMBSTONE_BIT) {
+        rangeTombstones.add(
+          record->key, record->value, record->sequence & ~utils::RANGE_TOMBSTONE_BIT);
+        continue;
+      }
+      auto recordIt = records.find(record->key);
+      if (recordIt == records.end()) {
+        recordIt = records.emplace(std::string(record->key), std::vector<Version>()).first;
+      }
+      recordIt->second.emplace_back(record->sequence, std::string(record->value));
     }
 
+    writeRangeTombstones(segmentPath, rangeTombstones);
     std::ofstream output(segmentPath.data(), std::ios::binary);
-    for (const auto& [key, value] : records) {
-      utils::writeRecordToFile<false /*flush*/>(output, {key, value});
+    VersionRetention retention(snapshots, rangeTombstones);
+    for (const auto& [key, versions] : records) {
+      for (const auto& [sequence, value] : versions | std::views::reverse) {
+        if (retention.keep(key, sequence)) {
+          utils::writeRecordToFile<false /*flush*/>(output, {key, value, sequence});
+        }
+      }
     }
   }
 };
\ No newline at end of file
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <fstream>
+#include <filesystem>
+#include <format>
+#include <cstdint>
+#include <chrono>
+#include <deque>
+#include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <array>
+#include <functional>
+#include <istream>
+#include <cerrno>
+#include <csignal>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "CommittedStorage.hpp"
+#include "Utils.hpp"
+
+// A single change published by a primary to its followers.
+struct ReplicationEvent {
+  enum class Type : uint8_t {
+    // A set, remove or range removal appended to the primary's write-ahead log.
+    Write,
+    // The uncommitted writes were moved to the committing section.
+    PrepareCommit,
+    // A segment was shipped under 'segmentId', replacing 'mergedSegmentId' if it is set.
+    InstallSegment,
+    // The committing section was written out into the last installed segment.
+    FinishCommit,
+    // Sent periodically so that an idle follower still wakes up.
+    Heartbeat
+  };
+  static constexpr size_t NO_SEGMENT = std::numeric_limits<size_t>::max();
+
+  Type type;
+  std::string key{}; // Write: the key. InstallSegment: path of the shipped segment.
+  std::string value{}; // Write: the value.
+  size_t sequence = 0;
+  size_t segmentId = NO_SEGMENT;
+  size_t mergedSegmentId = NO_SEGMENT;
+};
+
+// How far a follower has got with applying its primary's stream.
+struct ReplicationStatus {
+  // Cleared once the stream ends or an event cannot be applied, after which the follower
+  // stops applying events and keeps serving what it already has. Nothing brings it back
+  // in sync: a follower that is unhealthy, or whose heartbeat is stale, has to be treated
+  // as failed and opened again, which discards its contents, and added to the primary again.
+  bool healthy = true;
+  std::string error;
+  // Sequence of the newest write applied.
+  size_t appliedSequence = 0;
+  // When the primary last checked in; it sends a heartbeat every half a second.
+  std::optional<std::chrono::steady_clock::time_point> lastHeartbeat;
+};
+
+// Publishes a primary's changes to one follower over a pipe, typically a named pipe
+// opened by the follower. Segments are not sent over the pipe: they are hard-linked into
+// the '<stream>.shipped' directory, so the follower can take over the primary's immutable
+// files. The directory must therefore be on the same filesystem as the primary, and the
+// follower's directory on the same filesystem as it, as the follower renames them.
+// Events are queued and written by a thread of the publisher's own, so that a slow follower
+// never holds up the primary. A follower that falls more than 'MAX_PENDING_EVENTS' behind,
+// or goes away, or whose segments cannot be shipped, is given up on and the publisher
+// reports itself as unhealthy. The follower then sees its stream end and stops following.
+// It is not caught up again; it has to be subscribed anew.
+class ReplicationPublisher {
+  static constexpr size_t MAX_PENDING_EVENTS = 1024 * 1024;
+  static constexpr int POLL_INTERVAL_MS = 100;
+
+  int _stream;
+  const std::string _shippingPath;
+  size_t _nextShipmentId = 0;
+
+  std::mutex _mutex;
+  std::condition_variable _wakeUp;
+  std::deque<ReplicationEvent> _pending;
+  bool _running = true;
+  std::atomic<bool> _healthy = true;
+  std::thread _thread;
+
+  static void encode(std::ostream& output, const ReplicationEvent& event) {
+    output.write(reinterpret_cast<const char*>(&event.type), sizeof(event.type));
+    utils::writeRecordToFile<false /*flush*/>(output, {event.key, event.value, event.sequence});
+    output.write(reinterpret_cast<const char*>(&event.segmentId), sizeof(size_t));
+    output.write(reinterpret_cast<const char*>(&event.mergedSegmentId), sizeof(size_t));
+  }
+
+  void enqueue(ReplicationEvent event) {
+    std::lock_guard lock(_mutex);
+    if (!_healthy) {
+      return;
+    }
+    if (_pending.size() >= MAX_PENDING_EVENTS) {
+      giveUp();
+    } else {
+      _pending.push_back(std::move(event));
+    }
+    _wakeUp.notify_one();
+  }
+
+  // Must be called with the mutex held.
+  void giveUp() {
+    _healthy = false;
+    _pending.clear();
+  }
+
+  bool keepWaiting() {
+    std::lock_guard lock(_mutex);
+    return _running && _healthy;
+  }
+
+  // Writes to the non-blocking stream, waiting for the follower to catch up while the
+  // publisher is running. Once it is stopping, a follower that stops reading is given up on.
+  bool send(std::string_view data) {
+    while (!data.empty()) {
+      const ssize_t written = ::write(_stream, data.data(), data.size());
+      if (written >= 0) {
+        data.remove_prefix(written);
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+      }
+      pollfd descriptor{_stream, POLLOUT, 0};
+      if (poll(&descriptor, 1, POLL_INTERVAL_MS) == 0 && !keepWaiting()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void publish() {
+    // A follower going away must not terminate the primary. The SIGPIPE raised by writing to
+    // it is left pending on this thread, which stops right after.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::deque<ReplicationEvent> events;
+    std::ostringstream buffer;
+    while (true) {
+      {
+        std::unique_lock lock(_mutex);
+        _wakeUp.wait(lock, [this] { return !_pending.empty() || !_running || !_healthy; });
+        // Pending events are still delivered when stopping
+        if (!_healthy || _pending.empty()) {
+          return;
+        }
+        events.swap(_pending);
+      }
+      buffer.str({});
+      for (const auto& event : events) {
+        encode(buffer, event);
+      }
+      events.clear();
+      if (!send(buffer.view())) {
+        _healthy = false;
+        return;
+      }
+    }
+  }
+
+  std::string ship(size_t segmentId, std::string_view segmentPath) {
+    const auto shippedPath = std::format("{}/{}-{}.data", _shippingPath, _nextShipmentId++, segmentId);
+    for (const auto& file : CommittedStorage::filePaths(segmentPath)) {
+      if (std::filesystem::exists(file)) {
+        std::filesystem::create_hard_link(file, shippedPath + file.substr(segmentPath.size()));
+      }
+    }
+    return shippedPath;
+  }
+public:
+  // Blocks until the follower opens the other end of 'streamPath'.
+  ReplicationPublisher(std::string_view streamPath)
+    : _stream(open(std::string(streamPath).c_str(), O_WRONLY)),
+    // Absolute, as the follower resolves the shipped paths against its own working directory
+    _shippingPath(std::format("{}.shipped", std::filesystem::absolute(streamPath).string()))
+  {
+    // Shipments left over by an earlier publisher would collide with this one's
+    std::filesystem::remove_all(_shippingPath);
+    std::filesystem::create_directories(_shippingPath);
+    if (_stream < 0) {
+      _healthy = false;
+      return;
+    }
+    fcntl(_stream, F_SETFL, fcntl(_stream, F_GETFL) | O_NONBLOCK);
+    _thread = std::thread(&ReplicationPublisher::publish, this);
+  }
+  ReplicationPublisher(const ReplicationPublisher&) = delete;
+  ReplicationPublisher& operator=(const ReplicationPublisher&) = delete;
+  ~ReplicationPublisher() {
+    {
+      std::lock_guard lock(_mutex);
+      _running = false;
+    }
+    _wakeUp.notify_one();
+    if (_thread.joinable()) {
+      _thread.join();
+    }
+    if (_stream >= 0) {
+      close(_stream);
+    }
+    // Nothing will take over the shipped files of a follower that was given up on
+    if (!_healthy) {
+      std::error_code error;
+      std::filesystem::remove_all(_shippingPath, error);
+    }
+  }
+
+  void write(const utils::Record& record) {
+    enqueue({
+      ReplicationEvent::Type::Write,
+      std::string(record.key),
+      std::string(record.value),
+      record.sequence});
+  }
+  void prepareCommit() {
+    enqueue({ReplicationEvent::Type::PrepareCommit});
+  }
+  // The segment is linked right away, while its files are known to exist.
+  void installSegment(
+    size_t segmentId,
+    std::string_view segmentPath,
+    size_t mergedSegmentId = ReplicationEvent::NO_SEGMENT)
+  {
+    if (!_healthy) {
+      return;
+    }
+    ReplicationEvent event{ReplicationEvent::Type::InstallSegment};
+    try {
+      event.key = ship(segmentId, segmentPath);
+    } catch (const std::filesystem::filesystem_error&) {
+      std::lock_guard lock(_mutex);
+      giveUp();
+      _wakeUp.notify_one();
+      return;
+    }
+    event.segmentId = segmentId;
+    event.mergedSegmentId = mergedSegmentId;
+    enqueue(std::move(event));
+  }
+  void finishCommit() {
+    enqueue({ReplicationEvent::Type::FinishCommit});
+  }
+  void heartbeat() {
+    enqueue({ReplicationEvent::Type::Heartbeat});
+  }
+  bool healthy() const {
+    return _healthy;
+  }
+};
+
+// Reads the stream a 'ReplicationPublisher' writes to without blocking in 'open' or 'read',
+// so that a follower can stop before its primary connects or while it is idle. Waits for
+// data as long as 'keepWaiting' holds, and ends once the primary closes the stream.
+class ReplicationStreamBuffer : public std::streambuf {
+  static constexpr int POLL_INTERVAL_MS = 100;
+
+  int _stream;
+  std::function<bool()> _keepWaiting;
+  std::array<char, 64 * 1024> _buffer;
+protected:
+  int_type underflow() override {
+    while (_stream >= 0) {
+      // Reading a pipe no writer has opened yet returns end-of-file, so wait for data first
+      pollfd descriptor{_stream, POLLIN, 0};
+      const int ready = poll(&descriptor, 1, POLL_INTERVAL_MS);
+      if (ready == 0) {
+        if (!_keepWaiting()) {
+          break;
+        }
+        continue;
+      }
+      if (ready < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      const ssize_t bytesRead = ::read(_stream, _buffer.data(), _buffer.size());
+      if (bytesRead > 0) {
+        setg(_buffer.data(), _buffer.data(), _buffer.data() + bytesRead);
+        return traits_type::to_int_type(_buffer[0]);
+      }
+      if (bytesRead == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        break;
+      }
+    }
+    return traits_type::eof();
+  }
+public:
+  ReplicationStreamBuffer(std::string_view streamPath, std::function<bool()> keepWaiting)
+    : _stream(open(std::string(streamPath).c_str(), O_RDONLY | O_NONBLOCK)),
+    _keepWaiting(std::move(keepWaiting)) {}
+  ReplicationStreamBuffer(const ReplicationStreamBuffer&) = delete;
+  ReplicationStreamBuffer& operator=(const ReplicationStreamBuffer&) = delete;
+  ~ReplicationStreamBuffer() {
+    if (_stream >= 0) {
+      close(_stream);
+    }
+  }
+  bool isOpen() const {
+    return _stream >= 0;
+  }
+};
+
+// Reads the events written by a 'ReplicationPublisher'.
+class ReplicationReader {
+  std::istream& _stream;
+  utils::RecordStreamIteration _records;
+public:
+  ReplicationReader(std::istream& stream) : _stream(stream), _records(stream) {}
+  std::optional<ReplicationEvent> next() {
+    ReplicationEvent event;
+    if (_stream.read(reinterpret_cast<char*>(&event.type), sizeof(event.type)).fail()) {
+      return std::nullopt;
+    }
+    auto record = _records.next();
+    if (!record) {
+      return std::nullopt;
+    }
+    event.key = record->key;
+    event.value = record->value;
+    event.sequence = record->sequence;
+    if (_stream.read(reinterpret_cast<char*>(&event.segmentId), sizeof(size_t)).fail()) {
+      return std::nullopt;
+    }
+    if (_stream.read(reinterpret_cast<char*>(&event.mergedSegmentId), sizeof(size_t)).fail()) {
+      return std::nullopt;
+    }
+    return event;
+  }
+};
\ No newline at end of file
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <optional>
+#include <algorithm>
+
+#include "CommittedStorage.hpp"
+
+struct ResidencyOptions {
+  // Bytes of segment files allowed to stay in memory. Residency is left to the kernel if unset.
+  std::optional<size_t> budget;
+  // Asks for the pinned indexes and filters to be backed by huge pages where the kernel can.
+  bool hugePages = false;
+};
+
+struct SegmentResidency {
+  size_t segmentId;
+  size_t dataBytes;
+  size_t residentDataBytes;
+  size_t metadataBytes;
+  size_t residentMetadataBytes;
+  bool metadataPinned;
+  // Set once locking metadata into memory has failed, after which it is no longer attempted
+  // for any segment until the manager is reconfigured.
+  bool pinningFailed;
+};
+
+// Keeps the memory-mapped segments within a memory budget.
+// Indexes and bloom filters are consulted by every lookup, so they are locked into memory
+// for all segments first. If that fails, typically on reaching RLIMIT_MEMLOCK, it is
+// reported by 'report' and not attempted again until the manager is reconfigured. Metadata
+// that is not locked is left to the kernel and not charged to the budget.
+// What is left of the budget goes to segment data, hottest segments first. Hot segments
+// are prefetched as far as the budget goes, and evicted past that. Cold segments, those
+// with no lookups or only a small share of the hottest one's, keep whatever is resident
+// if that fits in what is left, and are evicted otherwise.
+class ResidencyManager {
+  static constexpr size_t COLD_HEAT_RATIO = 16;
+
+  ResidencyOptions _options;
+  bool _pinningFailed = false;
+public:
+  using Segments = std::map<size_t, CommittedStorage, std::greater<>>;
+
+  void configure(const ResidencyOptions& options) {
+    _options = options;
+    _pinningFailed = false;
+  }
+
+  void rebalance(Segments& segments) {
+    if (!_options.budget) {
+      return;
+    }
+    size_t budget = *_options.budget;
+    for (auto& [_, segment] : segments) {
+      // Lookups land anywhere in the data, so readahead would only spend the budget
+      segment.adviseRandomAccess();
+      if (!_pinningFailed && !segment.pinMetadata(_options.hugePages)) {
+        _pinningFailed = true;
+      }
+      if (segment.metadataPinned()) {
+        budget -= std::min(budget, segment.metadataBytes());
+      }
+    }
+
+    std::vector<CommittedStorage*> byHeat;
+    for (auto& [_, segment] : segments) {
+      byHeat.push_back(&segment);
+    }
+    std::stable_sort(byHeat.begin(), byHeat.end(), [](const auto* lhs, const auto* rhs) {
+      return lhs->heat() > rhs->heat();
+    });
+    const size_t hottest = byHeat.empty() ? 0 : byHeat.front()->heat();
+    for (auto* segment : byHeat) {
+      const size_t heat = segment->heat();
+      const bool cold = (heat == 0) || (heat * COLD_HEAT_RATIO < hottest);
+      if (!cold) {
+        const size_t prefetched = std::min(segment->dataBytes(), budget);
+        if (prefetched != 0) {
+          segment->prefetchData(prefetched);
+        }
+        if (prefetched < segment->dataBytes()) {
+          segment->evictData(prefetched);
+        }
+        budget -= prefetched;
+      } else if (const size_t resident = segment->residentDataBytes(); resident <= budget) {
+        budget -= resident;
+      } else {
+        segment->evictData();
+      }
+      segment->coolDown();
+    }
+  }
+
+  std::vector<SegmentResidency> report(const Segments& segments) const {
+    std::vector<SegmentResidency> result;
+    for (const auto& [segmentId, segment] : segments) {
+      result.push_back({
+        segmentId,
+        segment.dataBytes(),
+        segment.residentDataBytes(),
+        segment.metadataBytes(),
+        segment.residentMetadataBytes(),
+        segment.metadataPinned(),
+        _pinningFailed});
+    }
+    return result;
+  }
+};
\ No newline at end of file
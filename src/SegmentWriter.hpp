@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <format>
+#include <stdexcept>
+
+#include "CommittedStorage.hpp"
+#include "Utils.hpp"
+
+// Builds a segment file, together with its index and bloom filter, from records supplied
+// in ascending key order. It does not need a running database, so segments can be built
+// offline or in another process and then handed over with 'Database::ingest'.
+// The records are left without a sequence; ingesting the segment assigns one to all of them.
+class SegmentWriter {
+  const std::string _path;
+  std::ofstream _data;
+  std::ofstream _index;
+  utils::BloomFilter _bloomFilter;
+  std::string _lastKey;
+  bool _empty = true;
+public:
+  SegmentWriter(std::string_view path)
+    : _path(path),
+    _data(_path, std::ios::binary | std::ios::trunc),
+    _index(std::format("{}.index", path), std::ios::binary | std::ios::trunc)
+  {}
+  ~SegmentWriter() {
+    finish();
+  }
+
+  void set(std::string_view key, std::string_view value) {
+    if (!_empty && key <= _lastKey) {
+      throw std::invalid_argument(
+        std::format("SegmentWriter: key '{}' is not greater than '{}'", key, _lastKey));
+    }
+    _empty = false;
+    _lastKey = key;
+
+    Index::append(_index, key, _data.tellp());
+    _bloomFilter.add(key);
+    utils::writeRecordToFile<false /*flush*/>(_data, {key, value, utils::UNASSIGNED_SEQUENCE});
+  }
+  void remove(std::string_view key) {
+    set(key, utils::TOMBSTONE);
+  }
+
+  // Writes the bloom filter and closes the files. The segment is ready to be ingested afterwards.
+  void finish() {
+    if (!_data.is_open()) {
+      return;
+    }
+    std::ofstream filterFile(CommittedStorage::filterPath(_path), std::ios::binary | std::ios::trunc);
+    _bloomFilter.write(filterFile);
+    _data.close();
+    _index.close();
+  }
+};
\ No newline at end of file
@@ -5,16 +5,31 @@
 #include <unordered_map>
 #include <optional>
 #include <fstream>
+#include <vector>
+#include <ranges>
 
 #include "Utils.hpp"
 
 // Stores uncommitted key-values in-memory, while also appending them to a write-ahead log file.
 // 'get' operations are therefore very performant, while 'set' and 'remove' are slower due to the
 // disk write and flush.
+// Only the latest version of a key is kept, unless a live snapshot can still see an
+// overwritten version, in which case it is retained until the storage is committed.
 class UncommittedStorage {
+  struct Version {
+    size_t sequence = 0;
+    std::string value;
+  };
+  struct Versions {
+    Version latest;
+    std::vector<Version> previous; // Oldest first
+  };
+
   const std::string _writeAheadLogPath;
-  utils::StringKeyHashTable<std::string> _data;
+  utils::StringKeyHashTable<Versions> _data;
+  utils::RangeTombstones _rangeTombstones;
   std::ofstream _writeAheadLog;
+  size_t _maxSequence = 0;
 public:
   UncommittedStorage(std::string_view writeAheadLogPath)
   : _writeAheadLogPath(writeAheadLogPath),
@@ -32,34 +47,109 @@ public:
     std::ifstream file(writeAheadLogPath.data(), std::ios::binary);
     utils::RecordStreamIteration it(file);
     while (auto record = it.next()) {
-      _data[record->key] = record->value;
+      if (record->sequence & utils::RANGE_TOMBSTONE_BIT) {
+        const size_t sequence = record->sequence & ~utils::RANGE_TOMBSTONE_BIT;
+        _rangeTombstones.add(record->key, record->value, sequence);
+        _maxSequence = std::max(_maxSequence, sequence);
+        continue;
+      }
+      _data[record->key].latest = {record->sequence, std::string(record->value)};
+      _maxSequence = std::max(_maxSequence, record->sequence);
     }
   }
 
-  void set(std::string_view key, std::string_view value) {
-    auto [it, inserted] = _data.try_emplace(key, value);
-    if (!inserted) {
-      if (it->second == value) {
-        return;
+  // Writes are made in two steps, so that the write-ahead log can be flushed without keeping
+  // readers out: 'log' appends a write to the log, and 'apply' then makes it visible in
+  // memory. Only one writer may use them at a time. 'set', 'remove' and 'removeRange' do both.
+
+  // Returns false, and logs nothing, if the write would not change the stored value.
+  bool log(std::string_view key, std::string_view value, size_t sequence) {
+    auto it = _data.find(key);
+    if (it != _data.end()) {
+      const auto& latest = it->second.latest;
+      const bool unchanged =
+        (latest.value == value) &&
+        (_rangeTombstones.newestCovering(key, utils::LATEST_SEQUENCE) < latest.sequence);
+      if (unchanged) {
+        return false;
       }
-      it->second = value;
     }
-    utils::writeRecordToFile<true /*flush*/>(_writeAheadLog, {key, value});
+    utils::writeRecordToFile<true /*flush*/>(_writeAheadLog, {key, value, sequence});
+    return true;
   }
 
-  bool get(std::string& output, std::string_view key) const {
-    if (auto it = _data.find(key); it != _data.end()) {
-      if (it->second == utils::TOMBSTONE) {
-        return false;
+  // 'newestSnapshot' is the sequence of the newest live snapshot, if any. An overwritten
+  // version that it can still see is kept around.
+  void apply(
+    std::string_view key,
+    std::string_view value,
+    size_t sequence,
+    std::optional<size_t> newestSnapshot)
+  {
+    auto [it, inserted] = _data.try_emplace(key);
+    auto& versions = it->second;
+    if (!inserted && newestSnapshot && *newestSnapshot >= versions.latest.sequence) {
+      versions.previous.push_back(std::move(versions.latest));
+    }
+    versions.latest = {sequence, std::string(value)};
+    _maxSequence = std::max(_maxSequence, sequence);
+  }
+
+  void set(
+    std::string_view key,
+    std::string_view value,
+    size_t sequence,
+    std::optional<size_t> newestSnapshot)
+  {
+    if (log(key, value, sequence)) {
+      apply(key, value, sequence, newestSnapshot);
+    }
+  }
+
+  utils::Lookup get(std::string& output, std::string_view key, size_t sequence) const {
+    const size_t removedAt = _rangeTombstones.newestCovering(key, sequence);
+    auto it = _data.find(key);
+    if (it == _data.end()) {
+      return removedAt ? utils::Lookup::Removed : utils::Lookup::Missing;
+    }
+    const auto& versions = it->second;
+    const Version* visible = nullptr;
+    if (versions.latest.sequence <= sequence) {
+      visible = &versions.latest;
+    } else {
+      for (const auto& version : versions.previous | std::views::reverse) {
+        if (version.sequence <= sequence) {
+          visible = &version;
+          break;
+        }
       }
-      output = it->second;
-      return true;
     }
-    return false;
+    if (!visible || visible->sequence < removedAt) {
+      return removedAt ? utils::Lookup::Removed : utils::Lookup::Missing;
+    }
+    if (visible->value == utils::TOMBSTONE) {
+      return utils::Lookup::Removed;
+    }
+    output = visible->value;
+    return utils::Lookup::Found;
+  }
+
+  void remove(std::string_view key, size_t sequence, std::optional<size_t> newestSnapshot) {
+    set(key, utils::TOMBSTONE, sequence, newestSnapshot);
   }
 
-  void remove(std::string_view key) {
-    set(key, utils::TOMBSTONE);
+  // Removes every key in [start, end).
+  void logRange(std::string_view start, std::string_view end, size_t sequence) {
+    utils::writeRecordToFile<true /*flush*/>(
+      _writeAheadLog, {start, end, sequence | utils::RANGE_TOMBSTONE_BIT});
+  }
+  void applyRange(std::string_view start, std::string_view end, size_t sequence) {
+    _rangeTombstones.add(start, end, sequence);
+    _maxSequence = std::max(_maxSequence, sequence);
+  }
+  void removeRange(std::string_view start, std::string_view end, size_t sequence) {
+    logRange(start, end, sequence);
+    applyRange(start, end, sequence);
   }
 
   // Clears the in-memory hash table and deletes the write-ahead log file.
@@ -68,8 +158,11 @@ public:
     std::filesystem::remove(_writeAheadLogPath);
     _writeAheadLog.open(_writeAheadLogPath, std::ios::app | std::ios::binary);
     _data.clear();
+    _rangeTombstones.clear();
   }
   auto size() const { return _data.size(); }
-  bool empty() const { return _data.empty(); }
+  bool empty() const { return _data.empty() && _rangeTombstones.empty(); }
+  auto maxSequence() const { return _maxSequence; }
   auto& data() { return _data; }
+  auto& rangeTombstones() { return _rangeTombstones; }
 };
\ No newline at end of file
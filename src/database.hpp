@@ -12,21 +12,57 @@
 #include <thread>
 #include <atomic>
 #include <unordered_set>
+#include <set>
+#include <mutex>
+#include <stdexcept>
+
+#include <sys/stat.h>
 
 #include "UnCommittedStorage.hpp"
 #include "CommittedStorage.hpp"
+#include "Replication.hpp"
+#include "Residency.hpp"
 #include "Utils.hpp"
 
 class Database {
   static constexpr auto MAX_UNCOMMITTED_ACTIONS = 100000;
   static constexpr auto MAX_SEGMENT_SIZE = 1024 * 1024 * 500; // 500MB
 
+  // Version of the on-disk format, recorded in a 'FORMAT' file in the database directory.
+  // Version 1 had no such file and no sequence numbers in its records.
+  static constexpr size_t FORMAT_VERSION = 2;
+
   const std::string _path;
   UncommittedStorage _uncommitted;
   utils::ProtectedResource<UncommittedStorage> _committing;
   utils::ProtectedResource<std::map<size_t, CommittedStorage, std::greater<>>> _committed;
+  utils::ProtectedResource<std::multiset<size_t>> _snapshots;
+  std::atomic<size_t> _nextSequence = 1;
+
+  // Serializes writers. Sequences are taken and the write-ahead log is flushed under it,
+  // so that readers are not kept waiting on the disk. Taken before any other mutex.
+  std::mutex _writeMutex;
+
+  // Guards the in-memory uncommitted storage, which snapshots may read from any thread.
+  // Writes are made visible and snapshots pinned under it, so a snapshot never sees a
+  // write half-applied. The visible sequence is that of the newest write readers can see.
+  std::mutex _uncommittedMutex;
+  size_t _visibleSequence = 0;
+
+  // Serializes changes to the set of segments: commits and merges on the background
+  // thread, ingests on the foreground one, and installs on a follower. Holding it is enough
+  // to use the segments without blocking reads, as long as the map itself is left alone.
+  std::mutex _segmentsMutex;
+
+  utils::ProtectedResource<std::vector<std::unique_ptr<ReplicationPublisher>>> _followers;
+  utils::ProtectedResource<ResidencyManager> _residency;
+
+  // Set on a read-only follower, whose background thread applies the primary's replication
+  // stream.
+  const bool _following = false;
+  utils::ProtectedResource<ReplicationStatus> _replicationStatus;
 
-  // Accessed by background thread only after init
+  // Accessed by background thread only after init, or with the segments mutex held
   std::atomic<bool> _running = true;
   size_t _nextCommitId = 0;
   std::unique_ptr<std::thread> _backgroundThread;
@@ -34,25 +70,406 @@ class Database {
   void background() {
     while (_running.load(std::memory_order_relaxed)) {
       commit();
+      rebalanceResidency();
+      dropUnhealthyFollowers();
+      notifyFollowers([](auto& follower) { follower.heartbeat(); });
       std::this_thread::sleep_for(std::chrono::milliseconds(500));
     }
   }
 
+  void follow(std::string streamPath) {
+    ReplicationStreamBuffer buffer(streamPath, [this] { return _running.load(std::memory_order_relaxed); });
+    if (!buffer.isOpen()) {
+      stopFollowing(std::format("could not open '{}'", streamPath));
+      return;
+    }
+    std::istream stream(&buffer);
+    ReplicationReader reader(stream);
+    while (_running.load(std::memory_order_relaxed)) {
+      auto event = reader.next();
+      if (!event) {
+        if (_running.load(std::memory_order_relaxed)) {
+          stopFollowing("the replication stream ended");
+        }
+        return;
+      }
+      try {
+        applyReplicationEvent(*event);
+      } catch (const std::exception& e) {
+        stopFollowing(std::format("could not apply a replication event: {}", e.what()));
+        return;
+      }
+    }
+  }
+
+  void stopFollowing(std::string error) {
+    auto status = _replicationStatus.access();
+    status->healthy = false;
+    status->error = std::move(error);
+  }
+
+  void applyReplicationEvent(const ReplicationEvent& event) {
+    switch (event.type) {
+    case ReplicationEvent::Type::Write: {
+      // The follower thread is the only writer, so the log is appended to without a lock
+      const size_t sequence = event.sequence & ~utils::RANGE_TOMBSTONE_BIT;
+      if (event.sequence & utils::RANGE_TOMBSTONE_BIT) {
+        _uncommitted.logRange(event.key, event.value, sequence);
+        std::lock_guard lock(_uncommittedMutex);
+        _uncommitted.applyRange(event.key, event.value, sequence);
+      } else if (_uncommitted.log(event.key, event.value, sequence)) {
+        std::lock_guard lock(_uncommittedMutex);
+        _uncommitted.apply(event.key, event.value, sequence, std::nullopt);
+      }
+      auto status = _replicationStatus.access();
+      status->appliedSequence = std::max(status->appliedSequence, sequence);
+      break;
+    }
+    case ReplicationEvent::Type::PrepareCommit: {
+      std::lock_guard lock(_uncommittedMutex);
+      moveUncommittedToCommitting();
+      break;
+    }
+    case ReplicationEvent::Type::InstallSegment: {
+      // Take over the shipped files instead of replaying the records they hold
+      std::lock_guard lock(_segmentsMutex);
+      const auto segmentPath = std::format("{}/{}.data", _path, event.segmentId);
+      CommittedStorage::removeFiles(segmentPath);
+      CommittedStorage::moveFiles(event.key, segmentPath);
+      CommittedStorage segment(segmentPath);
+      auto committed = _committed.access();
+      if (event.mergedSegmentId != ReplicationEvent::NO_SEGMENT) {
+        committed->erase(event.mergedSegmentId);
+        CommittedStorage::removeFiles(std::format("{}/{}.data", _path, event.mergedSegmentId));
+      }
+      committed->insert_or_assign(event.segmentId, std::move(segment));
+      break;
+    }
+    case ReplicationEvent::Type::FinishCommit:
+      _committing.access()->clear();
+      break;
+    case ReplicationEvent::Type::Heartbeat:
+      _replicationStatus.access()->lastHeartbeat = std::chrono::steady_clock::now();
+      rebalanceResidency();
+      break;
+    }
+  }
+
+  // Done under the segments mutex rather than the committed one, so that reads carry on
+  // while it makes its system calls.
+  void rebalanceResidency() {
+    std::lock_guard lock(_segmentsMutex);
+    _residency.access()->rebalance(_committed.unprotectedAccess());
+  }
+
+  // Only queues the events, so it can be called with the storage locks held: that is how
+  // followers receive them in the order they were applied.
+  template<typename F>
+  void notifyFollowers(F&& func) {
+    auto followers = _followers.access();
+    for (auto& follower : *followers) {
+      func(*follower);
+    }
+  }
+
+  // Stopping a publisher waits for its thread, so it is done on the background thread only.
+  void dropUnhealthyFollowers() {
+    std::vector<std::unique_ptr<ReplicationPublisher>> unhealthy;
+    {
+      auto followers = _followers.access();
+      for (auto& follower : *followers) {
+        if (!follower->healthy()) {
+          unhealthy.push_back(std::move(follower));
+        }
+      }
+      std::erase(*followers, nullptr);
+    }
+  }
+
+  static std::string formatPath(std::string_view path) {
+    return std::format("{}/FORMAT", path);
+  }
+
+  static void writeFormat(std::string_view path) {
+    std::ofstream(formatPath(path)) << FORMAT_VERSION;
+  }
+
+  // Rejects directories written in another format, rather than misreading their files.
+  // Returns 'path' so that it can run before the logs are replayed.
+  static std::string checkFormat(std::string_view path) {
+    if (std::ifstream file(formatPath(path)); file.is_open()) {
+      size_t version = 0;
+      file >> version;
+      if (version != FORMAT_VERSION) {
+        throw std::runtime_error(std::format(
+          "Database: '{}' uses on-disk format version {}, expected {}", path, version, FORMAT_VERSION));
+      }
+      return std::string(path);
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+      const auto extension = entry.path().extension();
+      if (extension == ".data" || extension == ".log") {
+        throw std::runtime_error(std::format(
+          "Database: '{}' was written in on-disk format version 1, which is no longer supported", path));
+      }
+    }
+    writeFormat(path);
+    return std::string(path);
+  }
+
+  // Discards whatever a follower's directory held, in whichever format it was written.
+  static std::string clearForFollowing(std::string_view path) {
+    std::vector<std::string> stale;
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+      if (entry.path().extension() == ".data") {
+        stale.push_back(entry.path().string());
+      }
+    }
+    for (const auto& segmentPath : stale) {
+      CommittedStorage::removeFiles(segmentPath);
+    }
+    std::filesystem::remove(std::format("{}/uncommitted.log", path));
+    std::filesystem::remove(std::format("{}/committing.log", path));
+    writeFormat(path);
+    return std::string(path);
+  }
+
+  // An ingest writes down the segments it moves before moving any of them, under the name
+  // of the stage it is in: 'staging' while inputs are moved in next to the database,
+  // 'publishing' once they are to be renamed into segments. Each line holds the segment id
+  // and the absolute path the segment was ingested from.
+  std::string ingestManifestPath(std::string_view stage) const {
+    return std::format("{}/ingest.{}", _path, stage);
+  }
+
+  std::string stagedSegmentPath(size_t segmentId) const {
+    return std::format("{}/{}.ingesting", _path, segmentId);
+  }
+
+  // Written under a temporary name and renamed, so that a manifest is never seen half-written.
+  void writeIngestManifest(const std::vector<std::pair<size_t, std::string>>& segments) {
+    const auto temporaryPath = ingestManifestPath("manifest");
+    {
+      std::ofstream manifest(temporaryPath);
+      for (const auto& [segmentId, sourcePath] : segments) {
+        manifest << segmentId << ' ' << sourcePath << '\n';
+      }
+      if (!manifest.flush()) {
+        throw std::runtime_error(std::format("Database::ingest: could not write '{}'", temporaryPath));
+      }
+    }
+    std::filesystem::rename(temporaryPath, ingestManifestPath("staging"));
+  }
+
+  std::vector<std::pair<size_t, std::string>> readIngestManifest(std::string_view stage) const {
+    std::vector<std::pair<size_t, std::string>> segments;
+    std::ifstream manifest(ingestManifestPath(stage));
+    size_t segmentId = 0;
+    std::string sourcePath;
+    while ((manifest >> segmentId) && manifest.ignore(1) && std::getline(manifest, sourcePath)) {
+      segments.emplace_back(segmentId, sourcePath);
+    }
+    return segments;
+  }
+
+  // Completes an ingest interrupted by a crash, or undoes it, depending on how far it got:
+  // segments being published are all renamed into place, while staged ones are moved back
+  // to where they were ingested from.
+  void recoverIngest() {
+    std::filesystem::remove(ingestManifestPath("manifest"));
+    if (std::filesystem::exists(ingestManifestPath("publishing"))) {
+      for (const auto& [segmentId, _] : readIngestManifest("publishing")) {
+        CommittedStorage::moveFiles(stagedSegmentPath(segmentId), std::format("{}/{}.data", _path, segmentId));
+      }
+      std::filesystem::remove(ingestManifestPath("publishing"));
+    }
+    if (std::filesystem::exists(ingestManifestPath("staging"))) {
+      for (const auto& [segmentId, sourcePath] : readIngestManifest("staging")) {
+        std::filesystem::remove(CommittedStorage::sequencePath(stagedSegmentPath(segmentId)));
+        CommittedStorage::moveFiles(stagedSegmentPath(segmentId), sourcePath);
+      }
+      std::filesystem::remove(ingestManifestPath("staging"));
+    }
+  }
+
+  // Checks that 'path' can be ingested: a well-formed segment with its keys in ascending
+  // order, on the database's filesystem, and without files that only the database writes.
+  void validateIngestedSegment(std::string_view path) const {
+    auto fail = [path](std::string_view reason) {
+      return std::invalid_argument(std::format("Database::ingest: '{}' {}", path, reason));
+    };
+    if (!std::filesystem::is_regular_file(path)) {
+      throw fail("does not exist");
+    }
+    struct stat segmentStat, databaseStat;
+    if (stat(path.data(), &segmentStat) != 0 || stat(_path.c_str(), &databaseStat) != 0 ||
+      segmentStat.st_dev != databaseStat.st_dev)
+    {
+      throw fail("is not on the same filesystem as the database");
+    }
+    for (const auto& databaseOnly : {CommittedStorage::sequencePath(path), std::format("{}.ranges", path)}) {
+      if (std::filesystem::exists(databaseOnly)) {
+        throw fail(std::format("comes with '{}', which is not written by a SegmentWriter", databaseOnly));
+      }
+    }
+    const auto filterPath = CommittedStorage::filterPath(path);
+    if (std::filesystem::exists(filterPath) &&
+      std::filesystem::file_size(filterPath) != sizeof(utils::BloomFilter))
+    {
+      throw fail("has a bloom filter of the wrong size");
+    }
+    const auto indexPath = std::format("{}.index", path);
+    if (std::filesystem::exists(indexPath) && !Index::isValidFileSize(std::filesystem::file_size(indexPath))) {
+      throw fail("has an index of the wrong size");
+    }
+
+    std::ifstream file(path.data(), std::ios::binary);
+    utils::RecordStreamIteration it(file);
+    std::string previousKey;
+    size_t end = 0;
+    for (bool first = true; auto record = it.next(); first = false) {
+      if (!first && record->key <= previousKey) {
+        throw fail(std::format("is not sorted: '{}' follows '{}'", record->key, previousKey));
+      }
+      previousKey = record->key;
+      end = file.tellg();
+    }
+    if (end != std::filesystem::file_size(path)) {
+      throw fail("ends with a truncated record");
+    }
+  }
+
+  void requirePrimary() const {
+    if (_following) {
+      throw std::logic_error("Database: not available on a read-only follower");
+    }
+  }
+
+  // Must be called with the write mutex, if there are other writers, and the uncommitted
+  // mutex held.
+  void moveUncommittedToCommitting() {
+    auto committing = _committing.access();
+    if (!committing->empty()) {
+      return;
+    }
+    std::filesystem::rename(_path + "/uncommitted.log", _path + "/committing.log");
+    committing->data().swap(_uncommitted.data());
+    committing->rangeTombstones().swap(_uncommitted.rangeTombstones());
+    _uncommitted.clear();
+    // Published while the committing section is held, so that followers see it before the
+    // commit that follows it
+    notifyFollowers([](auto& follower) { follower.prepareCommit(); });
+  }
+
   size_t getSegmentSize(size_t segmentId) {
     return std::filesystem::file_size(std::format("{}/{}.data", _path, segmentId));
   }
 
   void commitIfNecessary() {
-    if (_uncommitted.size() > MAX_UNCOMMITTED_ACTIONS) {
+    bool necessary = false;
+    {
+      std::lock_guard lock(_uncommittedMutex);
+      necessary = _uncommitted.size() > MAX_UNCOMMITTED_ACTIONS;
+    }
+    if (necessary) {
       prepareCommit();
     }
   }
+
+  bool uncommittedIsEmpty() {
+    std::lock_guard lock(_uncommittedMutex);
+    return _uncommitted.empty();
+  }
+
+  std::optional<size_t> newestSnapshot() {
+    auto snapshots = _snapshots.access();
+    if (snapshots->empty()) {
+      return std::nullopt;
+    }
+    return *snapshots->rbegin();
+  }
+
+  // Sorted sequences of the snapshots that compaction must preserve versions for.
+  std::vector<size_t> liveSnapshots() {
+    auto snapshots = _snapshots.access();
+    return std::vector<size_t>(snapshots->begin(), snapshots->end());
+  }
+
+  void releaseSnapshot(size_t sequence) {
+    auto snapshots = _snapshots.access();
+    snapshots->erase(snapshots->find(sequence));
+  }
+
+  std::string* get(std::string_view key, size_t sequence) {
+    thread_local std::string output;
+    auto result = utils::Lookup::Missing;
+    {
+      std::lock_guard lock(_uncommittedMutex);
+      result = _uncommitted.get(output, key, sequence);
+    }
+    if (result == utils::Lookup::Missing) {
+      result = _committing.access()->get(output, key, sequence);
+    }
+    if (result == utils::Lookup::Missing) {
+      // The handle must outlive the loop, or the segments would be read unlocked
+      auto segments = _committed.access();
+      for (auto& [_, committed] : *segments) {
+        result = committed.get(output, key, sequence);
+        if (result != utils::Lookup::Missing) {
+          break;
+        }
+      }
+    }
+    return (result == utils::Lookup::Found) ? &output : nullptr;
+  }
 public:
+  // A consistent read-only view of the database as of the moment it was taken.
+  // Writes, commits and merges may continue while it is alive; compaction keeps every
+  // version it can see. Can be read from any thread, but must not outlive the database.
+  class Snapshot {
+    Database* _database;
+    size_t _sequence;
+  public:
+    Snapshot(Database& database, size_t sequence) : _database(&database), _sequence(sequence) {}
+    Snapshot(Snapshot&& other)
+      : _database(std::exchange(other._database, nullptr)), _sequence(other._sequence) {}
+    Snapshot& operator=(Snapshot&&) = delete;
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+    ~Snapshot() {
+      if (_database) {
+        _database->releaseSnapshot(_sequence);
+      }
+    }
+    std::string* get(std::string_view key) const {
+      return _database->get(key, _sequence);
+    }
+    auto sequence() const { return _sequence; }
+  };
+
   Database(std::string_view path)
-    : _path(path),
+    : _path(checkFormat(path)),
     _uncommitted(std::string(path) + "/uncommitted.log"),
     _committing(std::string(path) + "/committing.log")
   {
+    recoverIngest();
+
+    // A crash can leave files of a segment whose segment file was never written or moved in.
+    // They would otherwise be picked up by the next segment of that id.
+    std::vector<std::filesystem::path> leftovers;
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+      const auto& file = entry.path();
+      const bool orphaned =
+        (file.extension() != ".data") &&
+        (file.stem().extension() == ".data") &&
+        !std::filesystem::exists(file.parent_path() / file.stem());
+      if (orphaned) {
+        leftovers.push_back(file);
+      }
+    }
+    for (const auto& file : leftovers) {
+      std::filesystem::remove(file);
+    }
     for (const auto& entry : std::filesystem::directory_iterator(path)) {
       if (entry.path().extension() == ".data") {
         const size_t segmentId = std::stoull(entry.path().stem().string());
@@ -60,51 +477,108 @@ public:
         _committed.access()->emplace(segmentId, CommittedStorage(entry.path().string()));
       }
     }
+    // Written records are committed in sequence order, so the newest segment holds the
+    // highest of them. Ingested segments are checked too, as an older one may have been
+    // assigned a sequence above the segments committed after it.
+    size_t maxSequence = 0;
+    if (auto committed = _committed.access(); !committed->empty()) {
+      maxSequence = committed->begin()->second.maxSequence();
+      for (const auto& [_, segment] : *committed) {
+        maxSequence = std::max(maxSequence, segment.ingestedSequence());
+      }
+    }
+    maxSequence = std::max(maxSequence, _uncommitted.maxSequence());
+    maxSequence = std::max(maxSequence, _committing.access()->maxSequence());
+    _nextSequence = maxSequence + 1;
+    _visibleSequence = maxSequence;
     _backgroundThread = std::make_unique<std::thread>(&Database::background, this);
   }
+
+  // Opens a read-only follower of the primary publishing to 'streamPath' (see 'addFollower').
+  // The follower owns 'path': whatever it held is discarded and replaced by the primary's
+  // contents. Shipped segments are renamed into 'path', so it must be on the same filesystem
+  // as the primary. A follower that stopped following is brought back by opening it again. Writes are rejected, and snapshots are unavailable as compaction runs on the primary.
+  struct Follow {
+    std::string_view streamPath;
+  };
+  Database(std::string_view path, Follow follow)
+    : _path(clearForFollowing(path)),
+    _uncommitted(std::string(path) + "/uncommitted.log"),
+    _committing(std::string(path) + "/committing.log"),
+    _following(true)
+  {
+    _backgroundThread = std::make_unique<std::thread>(
+      &Database::follow, this, std::string(follow.streamPath));
+  }
+
   ~Database() {
     _running.store(false, std::memory_order_relaxed);
     _backgroundThread->join();
+    if (_following) {
+      return;
+    }
     commit();
     prepareCommit();
     commit();
   }
 
   void set(std::string_view key, std::string_view value) {
-    _uncommitted.set(key, value);
+    requirePrimary();
+    {
+      std::lock_guard writeLock(_writeMutex);
+      const size_t sequence = _nextSequence++;
+      if (_uncommitted.log(key, value, sequence)) {
+        std::lock_guard lock(_uncommittedMutex);
+        _uncommitted.apply(key, value, sequence, newestSnapshot());
+        _visibleSequence = sequence;
+        notifyFollowers([&](auto& follower) { follower.write({key, value, sequence}); });
+      }
+    }
     commitIfNecessary();
   }
   void remove(std::string_view key) {
-    _uncommitted.remove(key);
-    commitIfNecessary();
+    set(key, utils::TOMBSTONE);
   }
-  std::string* get(std::string_view key) {
-    thread_local std::string output;
-    if (bool found = _uncommitted.get(output, key); found) {
-      return &output;
-    }
-    if (bool found = _committing.access()->get(output, key); found) {
-      return &output;
+  // Removes every key in [start, end) with a single range tombstone.
+  void removeRange(std::string_view start, std::string_view end) {
+    requirePrimary();
+    if (start >= end) {
+      return;
     }
-    for (auto& [_, committed] : *_committed.access()) {
-      if (bool found = committed.get(output, key); found) {
-        return &output;
-      }
+    {
+      std::lock_guard writeLock(_writeMutex);
+      const size_t sequence = _nextSequence++;
+      _uncommitted.logRange(start, end, sequence);
+      std::lock_guard lock(_uncommittedMutex);
+      _uncommitted.applyRange(start, end, sequence);
+      _visibleSequence = sequence;
+      notifyFollowers([&](auto& follower) {
+        follower.write({start, end, sequence | utils::RANGE_TOMBSTONE_BIT});
+      });
     }
-    return nullptr;
+    commitIfNecessary();
+  }
+  std::string* get(std::string_view key) {
+    return get(key, utils::LATEST_SEQUENCE);
+  }
+
+  Snapshot snapshot() {
+    requirePrimary();
+    std::lock_guard lock(_uncommittedMutex);
+    const size_t sequence = _visibleSequence;
+    _snapshots.access()->insert(sequence);
+    return Snapshot(*this, sequence);
   }
 
   void prepareCommit() {
-    auto committing = _committing.access();
-    if (!committing->empty()) {
-      return;
-    }
-    std::filesystem::rename(_path + "/uncommitted.log", _path + "/committing.log");
-    committing->data().swap(_uncommitted.data());
-    _uncommitted.clear();
+    requirePrimary();
+    std::lock_guard writeLock(_writeMutex);
+    std::lock_guard lock(_uncommittedMutex);
+    moveUncommittedToCommitting();
   }
 
   void commit() {
+    std::lock_guard lock(_segmentsMutex);
     mergeAdjacentSegments();
 
     if (_committing.access()->empty()) {
@@ -113,9 +587,16 @@ public:
 
     const size_t commitSegmentId = _nextCommitId++;
     const auto newSegmentPath = std::format("{}/{}.data", _path, commitSegmentId);
-    CommittedStorage::logToSegment(newSegmentPath, std::format("{}/committing.log", _path));
+    CommittedStorage::logToSegment(
+      newSegmentPath,
+      std::format("{}/committing.log", _path),
+      liveSnapshots());
     CommittedStorage newCommitted(newSegmentPath);
     _committed.access()->emplace(commitSegmentId, std::move(newCommitted));
+    notifyFollowers([&](auto& follower) {
+      follower.installSegment(commitSegmentId, newSegmentPath);
+      follower.finishCommit();
+    });
     _committing.access()->clear();
   }
 
@@ -126,6 +607,7 @@ public:
       CommittedStorage storage;
     };
     std::vector<MergedAction> merged;
+    const auto snapshots = liveSnapshots();
 
     const auto& segments = _committed.unprotectedAccess();
     auto first = segments.begin();
@@ -139,11 +621,15 @@ public:
         continue;
       }
 
+      // Range tombstones only need to outlive the records they cover
+      const bool isOldestSegment = std::next(second) == segments.end();
       const auto newSegmentPath = std::format("{}/{}_{}.data", _path, firstSegmentId, secondSegmentId);
       CommittedStorage::merge(
         newSegmentPath,
         std::format("{}/{}.data", _path, firstSegmentId),
-        std::format("{}/{}.data", _path, secondSegmentId));
+        std::format("{}/{}.data", _path, secondSegmentId),
+        snapshots,
+        isOldestSegment && snapshots.empty());
       merged.emplace_back(
         firstSegmentId,
         secondSegmentId,
@@ -151,23 +637,191 @@ public:
       first = std::next(second);
     }
 
-    auto committed = _committed.access();
-    for (auto& action : merged) {
-      // Remove the second segment from the committed storage
-      committed->erase(action.secondSegmentId);
-      std::filesystem::remove(std::format("{}/{}.data", _path, action.secondSegmentId));
-      std::filesystem::remove(std::format("{}/{}.data.index", _path, action.secondSegmentId));
+    {
+      auto committed = _committed.access();
+      for (auto& action : merged) {
+        // Remove the second segment from the committed storage
+        committed->erase(action.secondSegmentId);
+        CommittedStorage::removeFiles(std::format("{}/{}.data", _path, action.secondSegmentId));
+
+        // Replace the first segment with the merged segment
+        CommittedStorage::removeFiles(std::format("{}/{}.data", _path, action.firstSegmentId));
+        action.storage.rename(std::format("{}/{}.data", _path, action.firstSegmentId));
+        committed->insert_or_assign(action.firstSegmentId, std::move(action.storage));
+      }
+    }
+    // The segments mutex keeps the merged files in place while they are shipped
+    for (const auto& action : merged) {
+      notifyFollowers([&](auto& follower) {
+        follower.installSegment(
+          action.firstSegmentId,
+          std::format("{}/{}.data", _path, action.firstSegmentId),
+          action.secondSegmentId);
+      });
+    }
+  }
+
+  // Links segments built by a 'SegmentWriter' into the database as its newest segments.
+  // Pending writes are committed first, so the ingested records take precedence over
+  // everything written before, and each segment over the ones before it in 'paths'.
+  // Writes wait until the ingest is done, while reads carry on.
+  // The files are moved rather than copied, so they must be on the same filesystem.
+  // Either every segment is ingested or, if an exception is thrown, none is and the files
+  // are moved back. Every input is validated before anything is moved. If the process dies
+  // part-way, the next start-up finishes the ingest or moves the files back (see 'recoverIngest').
+  void ingest(const std::vector<std::string>& paths) {
+    requirePrimary();
+    for (const auto& path : paths) {
+      validateIngestedSegment(path);
+      if (std::ranges::count(paths, path) != 1) {
+        throw std::invalid_argument(std::format("Database::ingest: '{}' is listed twice", path));
+      }
+    }
+
+    // No write can slip in between the pending writes being committed and the ingested
+    // segments being sequenced after them
+    std::lock_guard writeLock(_writeMutex);
+    while (!uncommittedIsEmpty() || !_committing.access()->empty()) {
+      {
+        std::lock_guard uncommittedLock(_uncommittedMutex);
+        moveUncommittedToCommitting();
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    std::lock_guard lock(_segmentsMutex);
+    struct StagedSegment {
+      std::string sourcePath;
+      std::string stagedPath;
+      std::string segmentPath;
+      size_t segmentId;
+    };
+    std::vector<StagedSegment> staged;
+    std::vector<std::pair<size_t, std::string>> manifest;
+    for (const auto& path : paths) {
+      const size_t segmentId = _nextCommitId++;
+      staged.emplace_back(
+        path,
+        stagedSegmentPath(segmentId),
+        std::format("{}/{}.data", _path, segmentId),
+        segmentId);
+      manifest.emplace_back(segmentId, std::filesystem::absolute(path).string());
+    }
+    writeIngestManifest(manifest);
+    auto unstage = [this, &staged] {
+      for (const auto& segment : staged) {
+        std::filesystem::remove(CommittedStorage::sequencePath(segment.stagedPath));
+        CommittedStorage::moveFiles(segment.stagedPath, segment.sourcePath);
+      }
+      std::filesystem::remove(ingestManifestPath("staging"));
+    };
+
+    // Staged under names that are not loaded on start-up. Opening each one builds its index
+    // or filter if it came without them, so nothing is left to fail once they are published.
+    try {
+      for (const auto& segment : staged) {
+        CommittedStorage::moveFiles(segment.sourcePath, segment.stagedPath);
+        CommittedStorage storage(segment.stagedPath);
+      }
+    } catch (...) {
+      unstage();
+      throw;
+    }
+
+    // Published under the uncommitted mutex, so that snapshots either see every ingested
+    // segment or none of them
+    std::lock_guard uncommittedLock(_uncommittedMutex);
+    std::vector<std::pair<size_t, CommittedStorage>> ingested;
+    try {
+      for (size_t i = 0; i < staged.size(); ++i) {
+        CommittedStorage::assignSequence(staged[i].stagedPath, _nextSequence + i);
+      }
+      // From here on, a crash is recovered from by publishing every staged segment
+      std::filesystem::rename(ingestManifestPath("staging"), ingestManifestPath("publishing"));
+      for (const auto& segment : staged) {
+        CommittedStorage::moveFiles(segment.stagedPath, segment.segmentPath);
+      }
+      for (const auto& segment : staged) {
+        ingested.emplace_back(segment.segmentId, CommittedStorage(segment.segmentPath));
+      }
+    } catch (...) {
+      ingested.clear();
+      for (const auto& segment : staged) {
+        CommittedStorage::moveFiles(segment.segmentPath, segment.stagedPath);
+      }
+      if (std::filesystem::exists(ingestManifestPath("publishing"))) {
+        std::filesystem::rename(ingestManifestPath("publishing"), ingestManifestPath("staging"));
+      }
+      unstage();
+      throw;
+    }
+    std::filesystem::remove(ingestManifestPath("publishing"));
+    _nextSequence += staged.size();
+    _visibleSequence = _nextSequence - 1;
+    {
+      auto committed = _committed.access();
+      for (auto& [segmentId, segment] : ingested) {
+        committed->emplace(segmentId, std::move(segment));
+      }
+    }
+    for (const auto& segment : staged) {
+      notifyFollowers([&](auto& follower) {
+        follower.installSegment(segment.segmentId, segment.segmentPath);
+      });
+    }
+  }
+
+  // Starts publishing changes to a follower reading from 'streamPath', typically a named
+  // pipe, and blocks until the follower has opened it. The follower is first brought up to
+  // date: it is shipped every segment and then replayed the write-ahead logs.
+  void addFollower(std::string_view streamPath) {
+    requirePrimary();
+    auto follower = std::make_unique<ReplicationPublisher>(streamPath);
 
-      // Replace the first segment with the merged segment
-      std::filesystem::remove(std::format("{}/{}.data", _path, action.firstSegmentId));
-      std::filesystem::remove(std::format("{}/{}.data.index", _path, action.firstSegmentId));
-      action.storage.rename(std::format("{}/{}.data", _path, action.firstSegmentId));
-      committed->emplace(action.firstSegmentId, std::move(action.storage));
+    // Holding the write mutex until the follower is registered keeps writes from slipping
+    // in between the replayed logs and the first event it is notified of
+    std::lock_guard writeLock(_writeMutex);
+    std::lock_guard lock(_segmentsMutex);
+    std::lock_guard uncommittedLock(_uncommittedMutex);
+    auto committing = _committing.access();
+    for (const auto& [segmentId, _] : _committed.unprotectedAccess()) {
+      follower->installSegment(segmentId, std::format("{}/{}.data", _path, segmentId));
+    }
+    auto replayLog = [&follower](const std::string& logPath) {
+      std::ifstream log(logPath, std::ios::binary);
+      utils::RecordStreamIteration it(log);
+      while (auto record = it.next()) {
+        follower->write({record->key, record->value, record->sequence});
+      }
+    };
+    if (!committing->empty()) {
+      replayLog(_path + "/committing.log");
+      follower->prepareCommit();
+    }
+    replayLog(_path + "/uncommitted.log");
+    _followers.access()->push_back(std::move(follower));
+  }
+
+  // Progress of a follower, which only reports problems through it.
+  ReplicationStatus replicationStatus() {
+    if (!_following) {
+      throw std::logic_error("Database: replication status is only available on a follower");
     }
+    return *_replicationStatus.access();
+  }
+
+  // Bounds the memory used by the mapped segments; applied by the background thread.
+  void configureResidency(const ResidencyOptions& options) {
+    _residency.access()->configure(options);
+  }
+
+  std::vector<SegmentResidency> residency() {
+    std::lock_guard lock(_segmentsMutex);
+    return _residency.access()->report(_committed.unprotectedAccess());
   }
 
   void blockUntilAllCommitsAreDone() {
-    while (!_uncommitted.empty() || !_committing.access()->empty()) {
+    while (!uncommittedIsEmpty() || !_committing.access()->empty()) {
       std::this_thread::sleep_for(std::chrono::milliseconds(100));
       prepareCommit();
     }
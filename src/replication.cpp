@@ -0,0 +1,119 @@
+#include <iostream>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Utils.hpp"
+#include "Database.hpp"
+#include "SegmentWriter.hpp"
+
+// Runs a primary and a read-only follower in two processes connected by a named pipe.
+// The follower checks that it ends up with the primary's contents once the primary closes.
+
+constexpr auto PRIMARY_PATH = "replication_primary";
+constexpr auto FOLLOWER_PATH = "replication_follower";
+constexpr auto STREAM_PATH = "replication_stream";
+constexpr auto INGESTED_COUNT = 1000;
+
+std::string ingestedKey(size_t index) {
+  return std::format("ingested_key_{:08}", index);
+}
+
+// What the primary leaves behind: every tenth entry removed, and a range of the
+// ingested keys removed.
+std::optional<std::string> expectedValue(
+  const std::vector<std::pair<std::string, std::string>>& entries, size_t index)
+{
+  if (index < entries.size()) {
+    return (index % 10 == 0) ? std::nullopt : std::optional<std::string>(entries[index].second);
+  }
+  const size_t ingestedIndex = index - entries.size();
+  return (ingestedIndex >= 100 && ingestedIndex < 200) ? std::nullopt : std::optional<std::string>("ingested");
+}
+
+int follow(const std::vector<std::pair<std::string, std::string>>& entries) {
+  Database follower(FOLLOWER_PATH, Database::Follow{STREAM_PATH});
+  const auto start = std::chrono::steady_clock::now();
+  while (follower.replicationStatus().healthy) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  const auto timeFollowing = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start).count();
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < entries.size() + INGESTED_COUNT; ++i) {
+    const auto& key = (i < entries.size()) ? entries[i].first : ingestedKey(i - entries.size());
+    const auto* result = follower.get(key);
+    const auto expected = expectedValue(entries, i);
+    if ((result != nullptr) != expected.has_value() || (result && *result != *expected)) {
+      ++mismatches;
+    }
+  }
+  const auto status = follower.replicationStatus();
+  std::cout
+    << "follower: timeFollowing=" << timeFollowing << "ms"
+    << " appliedSequence=" << status.appliedSequence
+    << " stoppedBecause='" << status.error << "'"
+    << " mismatches=" << mismatches << std::endl;
+  return (mismatches == 0) ? 0 : 1;
+}
+
+void lead(const std::vector<std::pair<std::string, std::string>>& entries) {
+  Database primary(PRIMARY_PATH);
+  const size_t half = entries.size() / 2;
+
+  // The follower joins with some of the data committed and some still uncommitted
+  for (size_t i = 0; i < half / 2; ++i) {
+    primary.set(entries[i].first, entries[i].second);
+  }
+  primary.blockUntilAllCommitsAreDone();
+  for (size_t i = half / 2; i < half; ++i) {
+    primary.set(entries[i].first, entries[i].second);
+  }
+  primary.addFollower(STREAM_PATH);
+
+  for (size_t i = half; i < entries.size(); ++i) {
+    primary.set(entries[i].first, entries[i].second);
+  }
+  for (size_t i = 0; i < entries.size(); i += 10) {
+    primary.remove(entries[i].first);
+  }
+  {
+    SegmentWriter writer("replication_ingested.data");
+    for (size_t i = 0; i < INGESTED_COUNT; ++i) {
+      writer.set(ingestedKey(i), "ingested");
+    }
+  }
+  primary.ingest({"replication_ingested.data"});
+  primary.removeRange(ingestedKey(100), ingestedKey(200));
+  primary.blockUntilAllCommitsAreDone();
+}
+
+int main(int argc, char* argv[]) {
+  assert(argc == 2);
+  const auto ENTRIES_COUNT = std::stoi(argv[1]);
+  const auto entries = utils::createRandomEntries(ENTRIES_COUNT, 30, 100);
+
+  for (const auto* path : {PRIMARY_PATH, FOLLOWER_PATH}) {
+    std::filesystem::remove_all(path);
+    std::filesystem::create_directories(path);
+  }
+  std::filesystem::remove(STREAM_PATH);
+  if (mkfifo(STREAM_PATH, 0600) != 0) {
+    std::cerr << "could not create " << STREAM_PATH << std::endl;
+    return 1;
+  }
+
+  const pid_t follower = fork();
+  if (follower == 0) {
+    return follow(entries);
+  }
+  lead(entries);
+
+  int status = 0;
+  waitpid(follower, &status, 0);
+  const bool matched = WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+  std::cout << "primary: followerMatched=" << matched << std::endl;
+  return matched ? 0 : 1;
+}
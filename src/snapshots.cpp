@@ -0,0 +1,101 @@
+#include <iostream>
+
+#include "Utils.hpp"
+#include "Database.hpp"
+
+// Reads through snapshots while the database overwrites, removes and range-removes the
+// entries, commits them and merges the segments. Each snapshot must keep seeing the
+// entries as they were when it was taken.
+
+constexpr auto DATABASE_PATH = "snapshots_db";
+
+using Entries = std::vector<std::pair<std::string, std::optional<std::string>>>;
+
+// Commits everything written so far and waits for the background thread to merge the
+// segments into one.
+size_t commitAndMerge(Database& db) {
+  db.blockUntilAllCommitsAreDone();
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while ((db.residency().size() > 1) && (std::chrono::steady_clock::now() < deadline)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return db.residency().size();
+}
+
+template<typename Reader>
+size_t countMismatches(const Entries& expected, const Reader& read) {
+  size_t mismatches = 0;
+  for (const auto& [key, value] : expected) {
+    const auto* result = read(key);
+    if ((result != nullptr) != value.has_value() || (result && *result != *value)) {
+      ++mismatches;
+    }
+  }
+  return mismatches;
+}
+
+int main(int argc, char* argv[]) {
+  assert(argc == 2);
+  const auto ENTRIES_COUNT = std::stoi(argv[1]);
+  auto entries = utils::createRandomEntries(ENTRIES_COUNT, 30, 100);
+  std::ranges::sort(entries);
+  const auto [last, end] = std::ranges::unique(entries, {}, [](const auto& entry) { return entry.first; });
+  entries.erase(last, end);
+
+  std::filesystem::remove_all(DATABASE_PATH);
+  std::filesystem::create_directories(DATABASE_PATH);
+  Database db(DATABASE_PATH);
+
+  Entries original;
+  for (const auto& [key, value] : entries) {
+    db.set(key, value);
+    original.emplace_back(key, value);
+  }
+  commitAndMerge(db);
+  const auto originalSnapshot = db.snapshot();
+
+  // Every other entry is overwritten and every third one removed, half of it left
+  // uncommitted when the second snapshot is taken
+  Entries changed = original;
+  for (size_t i = 0; i < changed.size(); ++i) {
+    if (i == changed.size() / 2) {
+      db.prepareCommit();
+    }
+    if (i % 3 == 0) {
+      db.remove(changed[i].first);
+      changed[i].second = std::nullopt;
+    } else if (i % 2 == 0) {
+      db.set(changed[i].first, "changed");
+      changed[i].second = "changed";
+    }
+  }
+  const auto changedSnapshot = db.snapshot();
+  const size_t segmentsAfterChanges = commitAndMerge(db);
+
+  // A quarter of the entries are removed with a single range tombstone
+  Entries current = changed;
+  const size_t rangeStart = current.size() / 4;
+  const size_t rangeEnd = current.size() / 2;
+  db.removeRange(current[rangeStart].first, current[rangeEnd].first);
+  for (size_t i = rangeStart; i < rangeEnd; ++i) {
+    current[i].second = std::nullopt;
+  }
+  const size_t segmentsAfterRemoveRange = commitAndMerge(db);
+
+  const size_t originalMismatches = countMismatches(original, [&](const auto& key) {
+    return originalSnapshot.get(key);
+  });
+  const size_t changedMismatches = countMismatches(changed, [&](const auto& key) {
+    return changedSnapshot.get(key);
+  });
+  const size_t currentMismatches = countMismatches(current, [&](const auto& key) {
+    return db.get(key);
+  });
+  std::cout
+    << "segmentsAfterChanges=" << segmentsAfterChanges
+    << " segmentsAfterRemoveRange=" << segmentsAfterRemoveRange
+    << " originalMismatches=" << originalMismatches
+    << " changedMismatches=" << changedMismatches
+    << " currentMismatches=" << currentMismatches << std::endl;
+  return (originalMismatches == 0 && changedMismatches == 0 && currentMismatches == 0) ? 0 : 1;
+}
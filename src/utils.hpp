@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <ctype.h>
 #include <functional>
@@ -14,6 +15,10 @@
 #include <filesystem>
 #include <bitset>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <boost/interprocess/managed_mapped_file.hpp>
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
@@ -78,6 +83,9 @@ public:
   auto access() {
     return ProtectedResourceHandle(_resource, _mutex);
   }
+  auto& unprotectedAccess() {
+    return _resource;
+  }
   const auto& unprotectedAccess() const {
     return _resource;
   }
@@ -108,17 +116,84 @@ public:
   auto& operator[](size_t index) const { return _data[index]; }
   auto data() { return _data.data(); }
   auto data() const { return _data.data(); }
+
+  // Residency control over the mapped pages. Empty mappings have nothing to control.
+  size_t sizeInBytes() const { return _data.size_bytes(); }
+  bool lock() {
+    return _data.empty() || (mlock(_region.get_address(), _region.get_size()) == 0);
+  }
+  void unlock() {
+    if (!_data.empty()) {
+      munlock(_region.get_address(), _region.get_size());
+    }
+  }
+  // 'advice' is one of the MADV_* values. It applies to the first 'bytes' of the mapping.
+  void advise(int advice, size_t bytes = std::numeric_limits<size_t>::max()) {
+    if (!_data.empty()) {
+      madvise(_region.get_address(), std::min(bytes, _region.get_size()), advice);
+    }
+  }
+  // Drops the pages past the first 'keptBytes' from this mapping and asks the kernel to drop
+  // them from the page cache.
+  void evict(size_t keptBytes = 0) {
+    if (_data.empty()) {
+      return;
+    }
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t kept = std::min((keptBytes + pageSize - 1) / pageSize * pageSize, _region.get_size());
+    if (kept == _region.get_size()) {
+      return;
+    }
+    madvise(static_cast<char*>(_region.get_address()) + kept, _region.get_size() - kept, MADV_DONTNEED);
+    posix_fadvise(_file.get_mapping_handle().handle, kept, 0, POSIX_FADV_DONTNEED);
+  }
+  size_t residentBytes() const {
+    if (_data.empty()) {
+      return 0;
+    }
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    thread_local std::vector<unsigned char> pages;
+    pages.resize((_region.get_size() + pageSize - 1) / pageSize);
+    if (mincore(_region.get_address(), _region.get_size(), pages.data()) != 0) {
+      return 0;
+    }
+    const size_t residentPages = std::count_if(pages.begin(), pages.end(), [](auto page) {
+      return page & 1;
+    });
+    return std::min(residentPages * pageSize, sizeInBytes());
+  }
 };
 
 struct Record {
   std::string_view key;
   std::string_view value;
+  size_t sequence;
 };
 
 constexpr const char TOMBSTONE[] = "\0";
 
+// Every write is stamped with a monotonically increasing sequence number.
+// Reads at a given sequence only observe records with a sequence at or below it.
+constexpr size_t LATEST_SEQUENCE = std::numeric_limits<size_t>::max();
+
+// Records built outside of a database carry no sequence of their own. An ingested segment
+// assigns one sequence to all of them.
+constexpr size_t UNASSIGNED_SEQUENCE = 0;
+
+// Range tombstones share the write-ahead log with regular records. They are written as a
+// record from 'start' to 'end' whose sequence has this bit set.
+constexpr size_t RANGE_TOMBSTONE_BIT = size_t(1) << 63;
+
+// Outcome of looking up a key in a single storage layer. 'Removed' means a tombstone
+// shadows the key, so older layers must not be consulted.
+enum class Lookup {
+  Missing,
+  Found,
+  Removed
+};
+
 template<bool flush>
-static void writeRecordToFile(std::ofstream& file, const Record& record) {
+static void writeRecordToFile(std::ostream& file, const Record& record) {
   const size_t keySize = record.key.size();
   file.write(reinterpret_cast<const char*>(&keySize), sizeof(size_t));
   file.write(record.key.data(), record.key.size());
@@ -127,6 +202,8 @@ static void writeRecordToFile(std::ofstream& file, const Record& record) {
   file.write(reinterpret_cast<const char*>(&valueSize), sizeof(size_t));
   file.write(record.value.data(), record.value.size());
 
+  file.write(reinterpret_cast<const char*>(&record.sequence), sizeof(size_t));
+
   if constexpr (flush) {
     file.flush();
   }
@@ -144,6 +221,7 @@ public:
   struct RecordAndPosition {
     std::string_view key;
     std::string_view value;
+    size_t sequence;
     size_t position;
   };
   std::optional<RecordAndPosition> next() {
@@ -159,19 +237,22 @@ public:
     std::memcpy(&valueSize, _contents.data(), sizeof(size_t));
     result.value = std::string_view(_contents.data() + sizeof(size_t), valueSize);
     _contents.remove_prefix(sizeof(size_t) + valueSize);
+    std::memcpy(&result.sequence, _contents.data(), sizeof(size_t));
+    _contents.remove_prefix(sizeof(size_t));
     return result;
   }
 };
 
 class RecordStreamIteration {
-  std::ifstream& _file;
+  std::istream& _file;
   std::string _key;
   std::string _value;
 public:
-  RecordStreamIteration(std::ifstream& file) : _file(file) {}
+  RecordStreamIteration(std::istream& file) : _file(file) {}
   struct RecordAndPosition {
     std::string_view key;
     std::string_view value;
+    size_t sequence;
     size_t position;
   };
   std::optional<RecordAndPosition> next() {
@@ -191,8 +272,123 @@ public:
     if (_file.read(_value.data(), valueSize).fail()) {
       return std::nullopt;
     }
-    return RecordAndPosition{std::string_view(_key), std::string_view(_value), position};
+    size_t sequence;
+    if (_file.read(reinterpret_cast<char*>(&sequence), sizeof(size_t)).fail()) {
+      return std::nullopt;
+    }
+    return RecordAndPosition{std::string_view(_key), std::string_view(_value), sequence, position};
+  }
+};
+
+// Range tombstones, kept as sorted and non-overlapping fragments of the key space so that
+// the ones covering a key are found by binary search. Each fragment lists the sequences of
+// the tombstones covering it. Every key in [start, end) written before one of those
+// sequences is removed as of that sequence.
+struct RangeTombstoneFragment {
+  std::string start;
+  std::string end;
+  std::vector<size_t> sequences; // Ascending
+};
+
+class RangeTombstones {
+  std::vector<RangeTombstoneFragment> _fragments; // Sorted by 'start'
+
+  // The fragment covering 'key', if any.
+  const RangeTombstoneFragment* find(std::string_view key) const {
+    auto it = std::upper_bound(_fragments.begin(), _fragments.end(), key, [](auto key, const auto& fragment) {
+      return key < fragment.start;
+    });
+    if (it == _fragments.begin() || key >= std::prev(it)->end) {
+      return nullptr;
+    }
+    return &*std::prev(it);
   }
+
+  // Splits the fragment straddling 'key', if any, so that a fragment boundary falls on it.
+  void split(std::string_view key) {
+    auto it = std::upper_bound(_fragments.begin(), _fragments.end(), key, [](auto key, const auto& fragment) {
+      return key < fragment.start;
+    });
+    if (it == _fragments.begin()) {
+      return;
+    }
+    auto& fragment = *std::prev(it);
+    if (key <= fragment.start || key >= fragment.end) {
+      return;
+    }
+    RangeTombstoneFragment upper{std::string(key), std::move(fragment.end), fragment.sequences};
+    fragment.end = key;
+    _fragments.insert(it, std::move(upper));
+  }
+public:
+  void add(std::string_view start, std::string_view end, size_t sequence) {
+    if (start >= end) {
+      return;
+    }
+    split(start);
+    split(end);
+
+    // Fragments within [start, end) gain the sequence, and the gaps between them are filled
+    std::vector<RangeTombstoneFragment> covered;
+    std::string cursor(start);
+    auto first = std::lower_bound(_fragments.begin(), _fragments.end(), start, [](const auto& fragment, auto key) {
+      return fragment.start < key;
+    });
+    auto last = first;
+    for (; last != _fragments.end() && last->start < end; ++last) {
+      if (cursor < last->start) {
+        covered.push_back({cursor, last->start, {sequence}});
+      }
+      auto& sequences = last->sequences;
+      sequences.insert(std::upper_bound(sequences.begin(), sequences.end(), sequence), sequence);
+      cursor = last->end;
+      covered.push_back(std::move(*last));
+    }
+    if (cursor < end) {
+      covered.push_back({cursor, std::string(end), {sequence}});
+    }
+    auto position = _fragments.erase(first, last);
+    _fragments.insert(position, std::make_move_iterator(covered.begin()), std::make_move_iterator(covered.end()));
+  }
+  // Sequence of the newest tombstone covering 'key' that is visible at 'readSequence',
+  // or 0 if there is none.
+  size_t newestCovering(std::string_view key, size_t readSequence) const {
+    const auto* fragment = find(key);
+    if (!fragment) {
+      return 0;
+    }
+    auto it = std::upper_bound(fragment->sequences.begin(), fragment->sequences.end(), readSequence);
+    return (it == fragment->sequences.begin()) ? 0 : *std::prev(it);
+  }
+  // Sequence of the oldest tombstone that removes the version of 'key' written at
+  // 'sequence', or LATEST_SEQUENCE if there is none.
+  size_t oldestCoveringAfter(std::string_view key, size_t sequence) const {
+    const auto* fragment = find(key);
+    if (!fragment) {
+      return LATEST_SEQUENCE;
+    }
+    auto it = std::upper_bound(fragment->sequences.begin(), fragment->sequences.end(), sequence);
+    return (it == fragment->sequences.end()) ? LATEST_SEQUENCE : *it;
+  }
+  void append(const RangeTombstones& other) {
+    for (const auto& fragment : other._fragments) {
+      for (const size_t sequence : fragment.sequences) {
+        add(fragment.start, fragment.end, sequence);
+      }
+    }
+  }
+  size_t maxSequence() const {
+    size_t result = 0;
+    for (const auto& fragment : _fragments) {
+      result = std::max(result, fragment.sequences.back());
+    }
+    return result;
+  }
+  void clear() { _fragments.clear(); }
+  void swap(RangeTombstones& other) { _fragments.swap(other._fragments); }
+  auto begin() const { return _fragments.begin(); }
+  auto end() const { return _fragments.end(); }
+  bool empty() const { return _fragments.empty(); }
 };
 
 struct StringHash {
@@ -254,6 +450,9 @@ public:
   void clear() {
     _buckets.reset();
   }
+  void write(std::ostream& file) const {
+    file.write(reinterpret_cast<const char*>(&_buckets), sizeof(_buckets));
+  }
 };
 
 } // namespace utils
\ No newline at end of file